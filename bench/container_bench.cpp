@@ -0,0 +1,120 @@
+// std::vector / std::map / std::unordered_map with BuddyAllocator against std::allocator.
+//
+//     g++ -std=c++17 -O2 bench/container_bench.cpp malloc_3.cpp -o container_bench
+//     ./container_bench [elements]
+//
+// The ratio printed is std::allocator time over BuddyAllocator time, above 1 the buddy heap wins.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "../buddy_allocator.h"
+
+
+template <typename Alloc>
+using Vector = std::vector<int, Alloc>;
+
+template <typename Alloc>
+using Map = std::map<int, int, std::less<int>, Alloc>;
+
+template <typename Alloc>
+using UnorderedMap = std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, Alloc>;
+
+// Fills the container, reads it back and tears it down, returns milliseconds
+template <typename Fill>
+double timeRun(Fill fill){
+    auto start = std::chrono::steady_clock::now();
+    long sum = fill();
+    auto end = std::chrono::steady_clock::now();
+    if (sum == 42) {
+        printf(" "); // keeps the work observable
+    }
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+template <typename Alloc, typename... Args>
+long fillVector(int elements, Args&... args){
+    long sum = 0;
+    // Many short vectors, so the allocator sees a steady stream of growing blocks
+    for (int round = 0; round < elements / 1000; ++round) {
+        Vector<Alloc> v{Alloc(args...)};
+        for (int i = 0; i < 1000; ++i) {
+            v.push_back(i);
+        }
+        sum += v[round % 1000];
+    }
+    return sum;
+}
+
+template <typename Alloc, typename... Args>
+long fillMap(int elements, Args&... args){
+    Map<Alloc> m{std::less<int>(), Alloc(args...)};
+    for (int i = 0; i < elements; ++i) {
+        m[(i * 7919) % elements] = i;
+    }
+    long sum = 0;
+    for (int i = 0; i < elements; i += 3) {
+        m.erase(i);
+    }
+    for (const auto& entry : m) {
+        sum += entry.second;
+    }
+    return sum;
+}
+
+template <typename Alloc, typename... Args>
+long fillUnorderedMap(int elements, Args&... args){
+    UnorderedMap<Alloc> m{0, std::hash<int>(), std::equal_to<int>(), Alloc(args...)};
+    for (int i = 0; i < elements; ++i) {
+        m[i] = i;
+    }
+    long sum = 0;
+    for (int i = 0; i < elements; i += 3) {
+        m.erase(i);
+    }
+    for (const auto& entry : m) {
+        sum += entry.second;
+    }
+    return sum;
+}
+
+void report(const char* name, double std_ms, double buddy_ms){
+    printf("%-16s std::allocator %8.2f ms   BuddyAllocator %8.2f ms   (%.2fx)\n", name, std_ms, buddy_ms, std_ms / buddy_ms);
+}
+
+int main(int argc, char* argv[]){
+    int elements = (argc > 1) ? atoi(argv[1]) : 200000;
+    printf("%d elements\n", elements);
+
+    typedef std::pair<const int, int> Node;
+
+    double std_ms = timeRun([&]{ return fillVector<std::allocator<int>>(elements); });
+    double buddy_ms;
+    {
+        MemoryArrays heap;
+        buddy_ms = timeRun([&]{ return fillVector<BuddyAllocator<int>>(elements, heap); });
+    }
+    report("vector", std_ms, buddy_ms);
+
+    std_ms = timeRun([&]{ return fillMap<std::allocator<Node>>(elements); });
+    {
+        MemoryArrays heap;
+        buddy_ms = timeRun([&]{ return fillMap<BuddyAllocator<Node>>(elements, heap); });
+    }
+    report("map", std_ms, buddy_ms);
+
+    std_ms = timeRun([&]{ return fillUnorderedMap<std::allocator<Node>>(elements); });
+    {
+        MemoryArrays heap;
+        buddy_ms = timeRun([&]{ return fillUnorderedMap<BuddyAllocator<Node>>(elements, heap); });
+    }
+    report("unordered_map", std_ms, buddy_ms);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+// Mixed-lifetime workload: smalloc alone against smalloc_hint with explicit and learned
+// (LIFETIME_AUTO) hints. Short-lived blocks stay in a ring of ring-size blocks and die
+// when their slot comes round again, every LONG_EVERY-th block lives to the end. The
+// fragmentation is measured once only the long-lived blocks are left. Without ring sizes
+// on the command line it sweeps a few, from a tiny working set to one that spans many
+// top blocks.
+//
+//     g++ -std=c++17 -O2 bench/lifetime_bench.cpp malloc_3.cpp -o lifetime_bench
+//     ./lifetime_bench [allocations] [ring-size...]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../malloc_3.h"
+
+#define LONG_EVERY 16
+
+enum Mode {
+    PLAIN,
+    HINTED,
+    LEARNED
+};
+
+// Each mode gets the same sizes
+unsigned int seed;
+size_t nextSize(){
+    seed = seed * 1103515245 + 12345;
+    return 16 + (seed >> 16) % 1000;
+}
+
+// Two call sites, so LIFETIME_AUTO can tell them apart. The empty asm keeps the calls from
+// becoming tail calls, which would hand smalloc_hint the same return address for both.
+__attribute__((noinline)) void* shortSite(size_t size){
+    void* p = smalloc_hint(size, LIFETIME_AUTO);
+    asm volatile("" ::: "memory");
+    return p;
+}
+
+__attribute__((noinline)) void* longSite(size_t size){
+    void* p = smalloc_hint(size, LIFETIME_AUTO);
+    asm volatile("" ::: "memory");
+    return p;
+}
+
+void* allocate(Mode mode, size_t size, bool longLived){
+    switch (mode) {
+        case HINTED:
+            return smalloc_hint(size, longLived ? LIFETIME_LONG : LIFETIME_SHORT);
+        case LEARNED:
+            return longLived ? longSite(size) : shortSite(size);
+        default:
+            return smalloc(size);
+    }
+}
+
+void run(const char* name, Mode mode, int allocations, int ringSize){
+    seed = 1;
+    std::vector<void*> longBlocks;
+    std::vector<void*> ring(ringSize, nullptr);
+    size_t failed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < allocations; ++i) {
+        bool longLived = (i % LONG_EVERY) == LONG_EVERY - 1;
+        void* p = allocate(mode, nextSize(), longLived);
+        if (!p) {
+            failed++;
+            continue;
+        }
+        if (longLived) {
+            longBlocks.push_back(p);
+        } else {
+            sfree(ring[i % ringSize]);
+            ring[i % ringSize] = p;
+        }
+    }
+    for (void* p : ring) {
+        sfree(p);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    // Free bytes stranded in top blocks that the long-lived blocks keep partly in use
+    sconsolidate();
+    size_t live = _num_allocated_bytes() - _num_free_bytes();
+    size_t fragmented = _num_fragmented_bytes();
+    printf("%-8s %7.2f ms   live %8zu bytes   fragmented %8zu bytes (%5.1f%%)   failed %zu\n", name,
+           std::chrono::duration<double, std::milli>(end - start).count(),
+           live, fragmented, 100.0 * fragmented / (live + fragmented), failed);
+
+    for (void* p : longBlocks) {
+        sfree(p);
+    }
+    sconsolidate();
+}
+
+int main(int argc, char* argv[]){
+    int allocations = (argc > 1) ? atoi(argv[1]) : 40000;
+    std::vector<int> ringSizes;
+    for (int i = 2; i < argc; ++i) {
+        ringSizes.push_back(atoi(argv[i]));
+    }
+    if (ringSizes.empty()) {
+        ringSizes = {16, 512, 2048};
+    }
+
+    for (int ringSize : ringSizes) {
+        printf("%d allocations, 1 in %d long lived, %d short lived in flight\n", allocations, LONG_EVERY, ringSize);
+        run("plain", PLAIN, allocations, ringSize);
+        run("hinted", HINTED, allocations, ringSize);
+        run("learned", LEARNED, allocations, ringSize);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#ifndef BUDDY_ALLOCATOR_H
+#define BUDDY_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+#include "malloc_3.h"
+
+
+////////////// STL allocator over a buddy heap
+//
+// Every BuddyHeap instance is an independent heap with its own arena, so a container
+// (or a whole subsystem) can be given a heap of its own, of any shape:
+//
+//     MemoryArrays heap;
+//     std::vector<int, BuddyAllocator<int>> v{BuddyAllocator<int>(heap)};
+//
+// The heap gives its arena back when it is destroyed, so it has to outlive the container.
+// deallocate passes the size through, so the block order comes from the size and not
+// from the header's order field. Blocks have to go back to the heap they came from (not to sfree).
+
+template <typename T, typename Heap = MemoryArrays>
+class BuddyAllocator{
+public:
+    typedef T value_type;
+
+    // Payloads start right after a header inside MinBlock aligned blocks
+    static_assert(alignof(T) <= Heap::Header::alignment, "BuddyAllocator can't satisfy this alignment");
+
+    Heap* heap;
+
+    explicit BuddyAllocator(Heap& heap) noexcept : heap(&heap) {}
+
+    template <typename U>
+    BuddyAllocator(const BuddyAllocator<U, Heap>& other) noexcept : heap(other.heap) {}
+
+    T* allocate(size_t n){
+        if(n == 0 || n > Heap::max_alloc_size / sizeof(T)){
+            throw std::bad_alloc();
+        }
+        void* p = heap->allocate(n * sizeof(T));
+        if(!p){
+            throw std::bad_alloc();
+        }
+        return (T*)p;
+    }
+
+    void deallocate(T* p, size_t n) noexcept{
+        heap->deallocate(p, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U, typename Heap>
+bool operator==(const BuddyAllocator<T, Heap>& a, const BuddyAllocator<U, Heap>& b) noexcept{
+    return a.heap == b.heap;
+}
+
+template <typename T, typename U, typename Heap>
+bool operator!=(const BuddyAllocator<T, Heap>& a, const BuddyAllocator<U, Heap>& b) noexcept{
+    return a.heap != b.heap;
+}
+
+
+////////////// std::pmr::memory_resource over a buddy heap
+//
+// The resource owns its heap, so the whole arena goes back when the resource is destroyed.
+// memory_resource::allocate(bytes) asks for alignof(std::max_align_t), so the default
+// resource pads its headers to that and every payload comes out max aligned. Larger
+// alignments (pool resources ask for 64) over-allocate and keep the block's address
+// in the word right before the aligned pointer.
+
+#if __cplusplus >= 201703L
+
+template <typename Heap>
+class BasicBuddyMemoryResource : public std::pmr::memory_resource{
+public:
+    Heap heap;
+
+    BasicBuddyMemoryResource() = default;
+    BasicBuddyMemoryResource(const BasicBuddyMemoryResource&) = delete;
+    BasicBuddyMemoryResource& operator=(const BasicBuddyMemoryResource&) = delete;
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override{
+        if(bytes == 0 || bytes > Heap::max_alloc_size || alignment > Heap::max_alloc_size - bytes){
+            throw std::bad_alloc();
+        }
+        if(alignment <= Heap::Header::alignment){
+            void* p = heap.allocate(bytes);
+            if(!p){
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        char* block = (char*)heap.allocate(bytes + alignment);
+        if(!block){
+            throw std::bad_alloc();
+        }
+        char* aligned = (char*)(((uintptr_t)block + sizeof(void*) + alignment - 1) & ~((uintptr_t)alignment - 1));
+        ((void**)aligned)[-1] = block;
+        return aligned;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override{
+        if(alignment <= Heap::Header::alignment){
+            heap.deallocate(p, bytes);
+        } else {
+            heap.deallocate(((void**)p)[-1], bytes + alignment);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override{
+        return this == &other;
+    }
+};
+
+struct MaxAlignBuddyPolicy : DefaultBuddyPolicy {
+    typedef InlineHeader<alignof(std::max_align_t)> Header;
+};
+
+typedef BuddyHeap<MIN_BLOCK_SIZE, MAX_ORDER, ARENA_BLOCKS, MaxAlignBuddyPolicy> MaxAlignArrays;
+typedef BasicBuddyMemoryResource<MaxAlignArrays> BuddyMemoryResource;
+
+#endif
+
+
+#endif //BUDDY_ALLOCATOR_H
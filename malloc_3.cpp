@@ -1,63 +1,15 @@
 #include <unistd.h>
 #include <cstring>
+#include <new>
 
-#include <cmath>
 #include <sys/mman.h>
 #include <cstdint>
 
-#define MAX_ORDER 10
-#define MAX_BLOCK_SIZE 128*1024
-
-
-////////////// Declearations
-
-struct MallocMetadata {
-    int order;
-    size_t mm_data_size;
-    bool is_free;
-    MallocMetadata* next;
-    MallocMetadata* prev;
-};
-
-
-
-class MemoryBlocksList{
-public:
-    MallocMetadata* m_list_head;
-
-    size_t num_blocks;
-    size_t num_bytes;
-    size_t meta_data_bytes;
-
-
-    int order_list;
-    bool is_free_list;
-
-
-    MemoryBlocksList(){};
-    MemoryBlocksList(int order, bool is_free);
-    void add_new_block(MallocMetadata*);
-//    void* find_first_free_block(size_t size);
-    void* remove_block(MallocMetadata*);
-};
-
-
-void* smalloc(size_t size);
-void* scalloc(size_t num, size_t size);
-void sfree(void* p);
-void* srealloc(void* oldp, size_t size);
-size_t _num_free_blocks();
-size_t _num_free_bytes();
-size_t _num_allocated_blocks();
-size_t _num_allocated_bytes();
-size_t _num_meta_data_bytes();
-size_t _size_meta_data();
-
-
+#include "malloc_3.h"
 
 
 //////////////////// Implementations
-MemoryBlocksList::MemoryBlocksList(int order, bool is_free){
+MemoryBlocksList::MemoryBlocksList(int order, bool is_free, size_t block_size, size_t meta_size, BlockCounts* totals){
 
     num_blocks = 0;
     num_bytes = 0;
@@ -68,62 +20,49 @@ MemoryBlocksList::MemoryBlocksList(int order, bool is_free){
     m_list_head = nullptr;
     order_list = order;
     is_free_list = is_free;
+    this->block_size = block_size;
+    this->meta_size = meta_size;
+    this->totals = totals;
 
 }
 
+void MemoryBlocksList::update_counts(MallocMetadata* data, bool added) {
+    // block_size is 0 for lists without a fixed order (mmap'ed blocks), their size is in the header
+    size_t bytes = block_size ? block_size - meta_size : data->mm_data_size;
+    if (added) {
+        num_blocks++;
+        num_bytes += bytes;
+        meta_data_bytes += meta_size;
+        if (totals) {
+            totals->num_blocks++;
+            totals->num_bytes += bytes;
+            totals->meta_data_bytes += meta_size;
+        }
+    } else {
+        num_blocks--;
+        num_bytes -= bytes;
+        meta_data_bytes -= meta_size;
+        if (totals) {
+            totals->num_blocks--;
+            totals->num_bytes -= bytes;
+            totals->meta_data_bytes -= meta_size;
+        }
+    }
+}
+
 
 void MemoryBlocksList::add_new_block(MallocMetadata* data) {
 
     // Input Validation
     if(!data) return;
 
-    // Update Block Counts & Metadata Size
-    num_blocks++;
-    meta_data_bytes = sizeof(MallocMetadata) * num_blocks;
-
-    // Calculate Total Bytes (Based on Order)
-    num_bytes = 0;
-    if(order_list > -1 && order_list < 11){
-        num_bytes = (num_blocks * ((size_t)(pow(2,order_list)*128) - sizeof(MallocMetadata)));
-    }
-
     // Set Metadata for the New Block
-    data->order = order_list;
-    data->is_free = is_free_list;
-    data->next = nullptr;
-    data->prev = nullptr;
-
-    // Handle First Block Insertion
-    if (num_blocks == 1){
-        m_list_head = data;
-        return;
-    }
-
-    // Find Insertion Point (Sorted by Address)
-    MallocMetadata* tmp = m_list_head;
-    MallocMetadata *prev_tmp = nullptr;
-    while( data > tmp && tmp != nullptr){ // Assumes 'tmp < data' compares memory addresses
-        prev_tmp = tmp;
-        tmp = tmp->next;
-    }
-
-    if (tmp != nullptr){
-        // Insert in Middle or Beginning
-        tmp->prev = data;
-        data->next = tmp;
-        data->prev = prev_tmp;
-        if (prev_tmp){
-            prev_tmp ->next = data;
-        }
-        else{ // New block is the new head
-            m_list_head = data;
-        }
-    } else {
-        prev_tmp->next = data;
-        data->prev = prev_tmp;
-        return;
-    }
+    data->in_quick_list = false;
+    data->remote_pending = false;
+    data->site_slot = 0;
 
+    // Insert at the head like push_block, so adding a block never walks the list
+    push_block(data);
 }
 
 
@@ -131,15 +70,7 @@ void * MemoryBlocksList::remove_block(MallocMetadata * block) {
 
     if(block == nullptr) return nullptr;
 
-    num_bytes = 0;
-
-
-    num_blocks--;
-    meta_data_bytes = sizeof(MallocMetadata) * num_blocks;
-
-    if(order_list > -1 && order_list < 11){
-        num_bytes = (num_blocks * ((size_t)(pow(2,order_list)*128) - sizeof(MallocMetadata)));
-    }
+    update_counts(block, false);
 
 
     if (block != m_list_head){
@@ -159,6 +90,28 @@ void * MemoryBlocksList::remove_block(MallocMetadata * block) {
     }
 }
 
+void MemoryBlocksList::push_block(MallocMetadata* data) {
+
+    if(!data) return;
+
+    update_counts(data, true);
+
+    data->order = order_list;
+    data->is_free = is_free_list;
+
+    // LIFO insertion at the head, the lists are not kept in address order
+    data->prev = nullptr;
+    data->next = m_list_head;
+    if (m_list_head){
+        m_list_head->prev = data;
+    }
+    m_list_head = data;
+}
+
+MallocMetadata* MemoryBlocksList::pop_block() {
+    return (MallocMetadata*)remove_block(m_list_head);
+}
+
 //void* MemoryBlocksList::find_first_free_block(size_t size){
 //
 //    MallocMetadata* ptr = globalMemoryBlocksList.m_list_head;
@@ -172,221 +125,65 @@ void * MemoryBlocksList::remove_block(MallocMetadata * block) {
 //}
 
 
-size_t calculateBlockSizeFromOrder(int order)
-{
-    return (((-1 < order) && (order< 11)))?(size_t)(pow(2,order)*128 ):0;
-}
-
-size_t sizeOfThisOrder( int order)
-{
-    return ((-1 < order) && (order< 11))?calculateBlockSizeFromOrder(order) - sizeof(MallocMetadata):0;
-}
-
-
-int supposedOrderOfBlock(size_t size) {
-
-
-    int order = 0;
-    while (size > sizeOfThisOrder(order) && order <= 10) {
-        order++;
-    }
-
-    return (order > 10) ? -1 : order;
-}
-
-
-class MemoryArrays{
-public:
-    MemoryBlocksList freeArray[MAX_ORDER + 1];
-    MemoryBlocksList allocArray[MAX_ORDER + 1];
-    MemoryBlocksList mmMapedBlocks;
-
-    size_t num_free_blocks;
-    size_t num_free_Bytes;
-    size_t num_allocated_blocks;
-    size_t num_allocated_Bytes;
-    size_t num_meta_data_Bytes;
-    size_t size_meta_data;
-
-    MemoryArrays();
-    void changeStats();
-    void* initArray();
-    void* allocate(size_t size);
-    void* suitsbleBlock(size_t size);
-    void* allocateInHeap(MallocMetadata* where, size_t size);
-
-};
-
-MemoryArrays::MemoryArrays()
-{
-    size_meta_data = sizeof(MallocMetadata);
-    mmMapedBlocks = MemoryBlocksList(-1, false);
-
-    for (int i = 0; i < MAX_ORDER + 1; i++){
-        freeArray[i] = MemoryBlocksList(i, true);
-        allocArray[i] = MemoryBlocksList(i, false);
-    }
-
-}
-
-void * MemoryArrays::initArray()
-{
-    // Get the current break (program's end address)
-    void* programBreak = sbrk(0);
-    if (programBreak == (void*)-1) {
-        return nullptr; // sbrk failed
-    }
-
-    // Calculate alignment and offset
-    const size_t alignmentSize = 32 * 128 * 1024; // 4MB alignment
-    intptr_t addressOffset = alignmentSize - ((intptr_t)programBreak % alignmentSize);
+// The quick lists of DeferredCoalescingPolicy are switched on for smalloc by building this
+// file with -DDEFERRED_COALESCING=1. The macro is only read here, so the heap types in
+// malloc_3.h are the same in every translation unit.
+#ifndef DEFERRED_COALESCING
+#define DEFERRED_COALESCING 0
+#endif
 
-    // Extend the program break to achieve alignment
-    void* newProgramBreak = sbrk(addressOffset + alignmentSize);
-    if (newProgramBreak == (void*)-1) {
-        return nullptr; // sbrk failed
-    }
+void recordLifetime(MallocMetadata* meta);
 
-    // Adjust the aligned address
-    void* alignedAddress = (char*)newProgramBreak + addressOffset;
-
-    // Create and add memory blocks
-    MallocMetadata* blockMetadata = (MallocMetadata*)alignedAddress;
-    for (int i = 0; i < 32; ++i) {
-        blockMetadata = (MallocMetadata*)((char*)alignedAddress + (i * 128 * 1024));
-        freeArray[10].add_new_block(blockMetadata);
-    }
-
-    // Update internal states (assuming changeStats is defined elsewhere)
-    num_free_blocks = 0, num_free_Bytes = 0, num_allocated_blocks = 0, num_allocated_Bytes = 0, num_meta_data_Bytes = 0;
-    for(int i = 0; i < MAX_ORDER + 1; i++){
-        num_free_blocks += freeArray[i].num_blocks;
-        num_free_Bytes += freeArray[i].num_bytes;
-        num_allocated_blocks += (allocArray[i].num_blocks + freeArray[i].num_blocks);
-        num_allocated_Bytes += (allocArray[i].num_bytes + freeArray[i].num_bytes);
-        num_meta_data_Bytes += (allocArray[i].meta_data_bytes + freeArray[i].meta_data_bytes);
-    }
-    //// MMMAPBLOCKS contiue later /// CHANGE TALIA
-    MallocMetadata* tmp = mmMapedBlocks.m_list_head;
-    while (tmp){
-        num_allocated_Bytes+= tmp->mm_data_size;
-        num_allocated_blocks++;
-        num_meta_data_Bytes += size_meta_data;
-        tmp = tmp->next;
-    }
+// smalloc may be called from any thread, so its heaps take a real lock. They also feed
+// the lifetimes of freed blocks back to their call sites.
+#if DEFERRED_COALESCING
+struct SmallocPolicy : DeferredCoalescingPolicy {
+#else
+struct SmallocPolicy : DefaultBuddyPolicy {
+#endif
+    typedef std::mutex Lock;
 
-    // Return a success indicator (non-null value)
-    return (void*)1;
-}
-
-void MemoryArrays::changeStats() {
-
-    size_t t_num_free_blocks = 0, t_num_free_Bytes = 0, t_num_allocated_blocks = 0, t_num_allocated_Bytes = 0, t_num_meta_data_Bytes = 0;
-    for(int i = 0; i < MAX_ORDER + 1; i++){
-        t_num_free_blocks += freeArray[i].num_blocks;
-        t_num_free_Bytes += freeArray[i].num_bytes;
-        t_num_allocated_blocks += (allocArray[i].num_blocks + freeArray[i].num_blocks);
-        t_num_allocated_Bytes += (allocArray[i].num_bytes + freeArray[i].num_bytes);
-        t_num_meta_data_Bytes += (allocArray[i].meta_data_bytes + freeArray[i].meta_data_bytes);
-    }
-    //// MMMAPBLOCKS contiue later /// CHANGE TALIA
-    MallocMetadata* tmp = mmMapedBlocks.m_list_head;
-    while (tmp != nullptr){
-        t_num_allocated_Bytes+= tmp->mm_data_size;
-        t_num_allocated_blocks++;
-        t_num_meta_data_Bytes += size_meta_data;
-        tmp = tmp->next;
-    }
-    num_free_blocks = t_num_free_blocks, num_free_Bytes = t_num_free_Bytes, num_allocated_blocks = t_num_allocated_blocks, num_allocated_Bytes = t_num_allocated_Bytes, num_meta_data_Bytes = t_num_meta_data_Bytes;
-}
-
-void* MemoryArrays::suitsbleBlock(size_t size) {
-    int order = supposedOrderOfBlock(size);
-    if(order == -1) return NULL;
-
-    while(order <= MAX_ORDER){
-        if(freeArray[order].m_list_head != nullptr){
-            return freeArray[order].m_list_head;
-        } else{
-            order ++;
-        }
-    }
-    return nullptr;
-}
-
-
-
-void*  MemoryArrays::allocateInHeap(MallocMetadata* where,size_t size){
-
-
-    freeArray[where->order].remove_block(where);
-    for(int i =  where->order - 1; i >= supposedOrderOfBlock(size); --i){
-        freeArray[i].add_new_block((MallocMetadata*)((char*)where + (int)(128 * pow(2, i))));
-    }
-    allocArray[supposedOrderOfBlock(size)].add_new_block(where);
-    changeStats();
-    return ((char*)where + size_meta_data);
-}
-
-void* MemoryArrays::allocate(size_t size){
-    MallocMetadata* where = (MallocMetadata*)suitsbleBlock(size);
-    if(!where){
-
-        if(supposedOrderOfBlock(size) != -1){
-            /////// if we got here that means that there is no free block that can contain 'size' bytes and size is not big enough for creating a page for it so we return null
-            return nullptr;
+    static void onFree(MallocMetadata* meta) {
+        if (meta->site_slot) {
+            recordLifetime(meta);
         }
-        /// code for mmap
-        void* new_block = mmap(NULL, size  + size_meta_data, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if(new_block == MAP_FAILED){
-            return nullptr;
-        }
-        MallocMetadata * meta = (MallocMetadata*)new_block;
-        meta->mm_data_size = size;
-        mmMapedBlocks.add_new_block(meta);
-        changeStats();
-        changeStats();
-
-        return ((char *)meta + size_meta_data);
     }
+};
 
-    return allocateInHeap(where,size);
-}
-
-
-
-MemoryArrays globalArrays = MemoryArrays();
-bool firstCall = true;
-
-
+typedef BuddyHeap<MIN_BLOCK_SIZE, MAX_ORDER, ARENA_BLOCKS, SmallocPolicy> SmallocArrays;
 
-size_t blockSize(int order){
-    return (size_t)(pow(2, order) * 128 );
-}
+// The smalloc heaps are built in static storage and never destroyed, so blocks can
+// still be freed from other static destructors after this file's are done
+alignas(SmallocArrays) unsigned char heapStorage[3][sizeof(SmallocArrays)];
 
+// smalloc keeps the original fixed pool of ARENA_BLOCKS top blocks
+SmallocArrays& globalArrays = *new (heapStorage[0]) SmallocArrays(1);
 
+// Heaps for blocks hinted as short or long lived, everything else uses globalArrays
+SmallocArrays& shortArrays = *new (heapStorage[1]) SmallocArrays();
+SmallocArrays& longArrays = *new (heapStorage[2]) SmallocArrays();
+SmallocArrays* allHeaps[] = {&globalArrays, &shortArrays, &longArrays};
 
+struct CallSiteLifetime {
+    void* site;
+    unsigned int avg_lifetime;
+    unsigned int samples;
+};
 
-void* firstCallForSmalloc(size_t size){
-    firstCall = false;
-    if(!globalArrays.initArray()){
-        return NULL;
-    }
-    if(size == 0 || size > 100000000){
-        return NULL;
-    }
-    return globalArrays.allocate(size);
-}
+// The site table is shared by every heap and thread, siteLock guards it. The clock is
+// bumped by every allocation on any thread.
+CallSiteLifetime callSites[SITE_SLOTS];
+SpinLock siteLock;
+std::atomic<unsigned int> allocationClock(0);
 
 
 void* smalloc(size_t size){
 
-    if(firstCall){
-        return firstCallForSmalloc(size);
-    }
-    if(size == 0 || size > 100000000){
+    allocationClock.fetch_add(1, std::memory_order_relaxed);
+    if(size == 0 || size > SmallocArrays::max_alloc_size){
         return NULL;
     }
+    // The first call reserves the arena, under the heap lock like every other allocation
     return globalArrays.allocate(size);
 }
 
@@ -401,48 +198,76 @@ void* scalloc(size_t num, size_t size){
 
 
 
-void freeMap(MallocMetadata* meta){
-
-    globalArrays.mmMapedBlocks.remove_block(meta);
-    munmap(meta, meta->mm_data_size + globalArrays.size_meta_data);
-    globalArrays.changeStats();
-    return;
-
+int siteSlotOf(void* site){
+    // Direct mapped, a colliding call site takes the slot over and starts learning again
+    int slot = (int)(((uintptr_t)site >> 4) % SITE_SLOTS);
+    if (callSites[slot].site != site) {
+        callSites[slot].site = site;
+        callSites[slot].avg_lifetime = 0;
+        callSites[slot].samples = 0;
+    }
+    return slot;
 }
 
+int predictLifetime(int slot){
+    if (callSites[slot].samples < SITE_MIN_SAMPLES) {
+        return LIFETIME_DEFAULT;
+    }
+    return (callSites[slot].avg_lifetime <= SHORT_SITE_LIFETIME) ? LIFETIME_SHORT : LIFETIME_LONG;
+}
 
+void recordLifetime(MallocMetadata* meta){
+    // Called from the heap's onFree, so every block is counted once and only when it is freed
+    std::lock_guard<SpinLock> guard(siteLock);
+    CallSiteLifetime& site = callSites[meta->site_slot - 1];
+    unsigned int lifetime = allocationClock.load(std::memory_order_relaxed) - meta->birth_tick;
 
-void freeHeap(MallocMetadata* meta) {
-    // Remove the block from the allocated list
-    globalArrays.allocArray[meta->order].remove_block(meta);
+    // Running average that weights the latest free by 1/8
+    if (site.samples == 0) {
+        site.avg_lifetime = lifetime;
+    } else {
+        site.avg_lifetime = site.avg_lifetime - site.avg_lifetime / 8 + lifetime / 8;
+    }
+    site.samples++;
+}
 
-    MallocMetadata* min_meta = meta;
-    int current_order = meta->order;
+void* smalloc_hint(size_t size, int hint){
 
-    // Attempt to merge with free buddies
-    bool canMerge = true;
-    while (canMerge) {
-        // Calculate the buddy's address
-        MallocMetadata* buddy_meta = (MallocMetadata*)((uintptr_t)min_meta ^ (size_t)(pow(2, current_order) * 128));
+    if(size == 0 || size > SmallocArrays::max_alloc_size){
+        return NULL;
+    }
 
-        // Check if merging is possible
-        canMerge = (current_order != MAX_ORDER
-                    && buddy_meta->is_free
-                    && buddy_meta->order == current_order);
+    int slot = -1;
+    if (hint == LIFETIME_AUTO) {
+        std::lock_guard<SpinLock> guard(siteLock);
+        slot = siteSlotOf(__builtin_return_address(0));
+        hint = predictLifetime(slot);
+    }
 
-        if (canMerge) {
-            // Remove buddy from the free list and merge
-            globalArrays.freeArray[buddy_meta->order].remove_block(buddy_meta);
-            min_meta = (min_meta < buddy_meta) ? min_meta : buddy_meta; // Choose the lower address as the new base
-            current_order++;
+    // mmap'ed blocks are tracked by the global heap whatever their hint
+    void* block;
+    if (hint == LIFETIME_DEFAULT || SmallocArrays::orderOf(size) == -1) {
+        block = smalloc(size);
+    } else {
+        allocationClock.fetch_add(1, std::memory_order_relaxed);
+        block = (hint == LIFETIME_SHORT ? shortArrays : longArrays).allocate(size);
+        if (!block) {
+            block = smalloc(size); // the hinted heap is full, the hint is only advice
         }
     }
 
-    // Add the (potentially merged) block to the free list
-    globalArrays.freeArray[current_order].add_new_block(min_meta);
+    if (block && slot != -1 && SmallocArrays::orderOf(size) != -1) {
+        MallocMetadata* meta = (MallocMetadata*)((char*)block - globalArrays.size_meta_data);
+        meta->birth_tick = allocationClock.load(std::memory_order_relaxed);
+        meta->site_slot = (unsigned short)(slot + 1);
+    }
+    return block;
+}
 
-    // Update global statistics
-    globalArrays.changeStats();
+SmallocArrays* heapOf(MallocMetadata* meta){
+    // mmap'ed blocks are tracked by the global heap
+    SmallocArrays* arena = SmallocArrays::arenaOf(meta);
+    return arena ? arena : &globalArrays;
 }
 
 void sfree(void* p){
@@ -452,12 +277,8 @@ void sfree(void* p){
     if(meta->is_free){
         return;
     }
-    if(meta->order == -1){
-        freeMap(meta);
-        return;
-    } else {
-        freeHeap(meta);
-    }
+
+    heapOf(meta)->freeBlock(meta);
 }
 
 
@@ -468,69 +289,82 @@ void* mapRealloc(void* oldp, size_t size,MallocMetadata* meta){
         return oldp;
     }
 
-    void* new_block = mmap(NULL, size + globalArrays.size_meta_data, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (new_block == MAP_FAILED) {
+    std::lock_guard<SmallocArrays::Lock> guard(globalArrays.heap_lock);
+    MallocMetadata* new_meta = globalArrays.mapBlock(size);
+    if (!new_meta) {
         return nullptr;
     }
 
-    MallocMetadata* new_meta = (MallocMetadata*)new_block;
-    new_meta->mm_data_size = size;
-    globalArrays.mmMapedBlocks.add_new_block(new_meta);
-    globalArrays.mmMapedBlocks.remove_block(meta);
-    globalArrays.changeStats();
-    memmove(((char*)new_block + globalArrays.size_meta_data), oldp, meta->mm_data_size);
-    munmap(meta, (meta->mm_data_size + globalArrays.size_meta_data));
-    return ((char*)new_block + globalArrays.size_meta_data);
+    size_t copy_size = (size < meta->mm_data_size) ? size : meta->mm_data_size;
+    memmove(((char*)new_meta + globalArrays.size_meta_data), oldp, copy_size);
+    globalArrays.freeMap(meta);
+    return ((char*)new_meta + globalArrays.size_meta_data);
 
 }
 
 
-void* canMergeBuddies(void* oldp, size_t size,int new_order,int curr_order,MallocMetadata* meta,MallocMetadata* min_meta){
+void* canMergeBuddies(SmallocArrays* heap, void* oldp, int new_order,int curr_order,MallocMetadata* meta,MallocMetadata* min_meta){
     min_meta = meta;
     for (int i = curr_order; i < new_order; ++i) {
-        MallocMetadata* buddy_meta = (MallocMetadata*)((uintptr_t)min_meta ^ blockSize(i));
-        globalArrays.freeArray[buddy_meta->order].remove_block(buddy_meta);
+        MallocMetadata* buddy_meta = (MallocMetadata*)((uintptr_t)min_meta ^ SmallocArrays::blockSize(i));
+        heap->freeArray[buddy_meta->order].remove_block(buddy_meta);
         min_meta = (min_meta < buddy_meta) ? min_meta : buddy_meta;
     }
 
-    globalArrays.allocArray[meta->order].remove_block(meta);
-    globalArrays.allocArray[new_order].add_new_block(min_meta);
-    globalArrays.changeStats();
-    memmove(((char*)min_meta + globalArrays.size_meta_data), oldp, blockSize(curr_order));
-    return ((char*)min_meta + globalArrays.size_meta_data);
+    heap->allocArray[meta->order].remove_block(meta);
+    heap->allocArray[new_order].add_new_block(min_meta);
+    heap->changeStats();
+    memmove(((char*)min_meta + heap->size_meta_data), oldp, SmallocArrays::payloadSize(curr_order));
+    return ((char*)min_meta + heap->size_meta_data);
 }
 
 void* heapRealloc(void* oldp, size_t size,MallocMetadata* meta){
 
-    int new_order = supposedOrderOfBlock(size);
+    int new_order = SmallocArrays::orderOf(size);
     int curr_order = meta->order;
 
-    if (new_order <= meta->order) {
+    // Sizes past the largest block (new_order == -1) have to move to an mmap'ed block
+    if (new_order != -1 && new_order <= curr_order) {
         return oldp;
     }
 
     MallocMetadata* min_meta = meta;
-    bool canMerge = true;
-
-    // Modified loop with explicit condition
-    for (int i = curr_order; i < new_order && canMerge; ++i) {
-        MallocMetadata* buddy_meta = (MallocMetadata*)((uintptr_t)min_meta ^ calculateBlockSizeFromOrder(i));
-        canMerge = (buddy_meta->is_free && buddy_meta->order == i);
+    bool canMerge = (new_order != -1);
+
+    // Stay in the heap the block came from (lifetime hinted blocks keep their heap). The
+    // buddies' headers belong to the heap, so they are only read under its lock.
+    SmallocArrays* heap = heapOf(meta);
+    {
+        std::lock_guard<SmallocArrays::Lock> guard(heap->heap_lock);
+
+        // Modified loop with explicit condition
+        for (int i = curr_order; i < new_order && canMerge; ++i) {
+            MallocMetadata* buddy_meta = (MallocMetadata*)((uintptr_t)min_meta ^ SmallocArrays::blockSize(i));
+            canMerge = (buddy_meta->is_free && !buddy_meta->in_quick_list && buddy_meta->order == i);
+
+            if (canMerge) {
+                min_meta = (min_meta < buddy_meta) ? min_meta : buddy_meta;
+            }
+        }
 
         if (canMerge) {
-            min_meta = (min_meta < buddy_meta) ? min_meta : buddy_meta;
+            return canMergeBuddies(heap,oldp,new_order,curr_order,meta,min_meta);
         }
     }
 
-    if (canMerge) {
-        return canMergeBuddies(oldp,size,new_order,curr_order,meta,min_meta);
-    } else {
-        void* pointer_to_return = smalloc(size);
-        memmove(pointer_to_return, oldp, blockSize(curr_order));
-        sfree(oldp);
-        return pointer_to_return;
+    void* pointer_to_return = nullptr;
+    if (heap != &globalArrays && new_order != -1) {
+        pointer_to_return = heap->allocate(size);
     }
-
+    if (!pointer_to_return) {
+        pointer_to_return = smalloc(size);
+    }
+    if (!pointer_to_return) {
+        return NULL; // like realloc, the old block stays valid
+    }
+    memmove(pointer_to_return, oldp, SmallocArrays::payloadSize(curr_order));
+    sfree(oldp);
+    return pointer_to_return;
 }
 
 void* srealloc(void* oldp, size_t size) {
@@ -547,30 +381,82 @@ void* srealloc(void* oldp, size_t size) {
     }
 }
 
+size_t sumOverHeaps(size_t SmallocArrays::*stat){
+    size_t sum = 0;
+    for (SmallocArrays* heap : allHeaps) {
+        sum += heap->*stat;
+    }
+    return sum;
+}
+
 size_t _num_free_blocks(){
-    return globalArrays.num_free_blocks;
+    return sumOverHeaps(&SmallocArrays::num_free_blocks);
 }
 
 size_t _num_free_bytes(){
-    return globalArrays.num_free_Bytes;
+    return sumOverHeaps(&SmallocArrays::num_free_Bytes);
 }
 
 size_t _num_allocated_blocks(){
-    return globalArrays.num_allocated_blocks;
+    return sumOverHeaps(&SmallocArrays::num_allocated_blocks);
 }
 
 size_t _num_allocated_bytes(){
-    return globalArrays.num_allocated_Bytes;
+    return sumOverHeaps(&SmallocArrays::num_allocated_Bytes);
 }
 
 size_t _num_meta_data_bytes(){
-    return globalArrays.num_meta_data_Bytes;
+    return sumOverHeaps(&SmallocArrays::num_meta_data_Bytes);
 }
 
 size_t _size_meta_data(){
     return globalArrays.size_meta_data;
 }
 
+size_t _num_mmap_calls(){
+    return globalArrays.num_mmap_calls;
+}
+
+size_t _num_munmap_calls(){
+    return globalArrays.num_munmap_calls;
+}
+
+size_t _num_mmap_cache_hits(){
+    return globalArrays.num_mmap_cache_hits;
+}
+
+size_t _num_cached_map_bytes(){
+    return sumOverHeaps(&SmallocArrays::cached_map_bytes);
+}
+
+size_t _mmap_threshold(){
+    return globalArrays.mmap_threshold;
+}
+
+size_t _num_fragmented_bytes(){
+    size_t sum = 0;
+    for (SmallocArrays* heap : allHeaps) {
+        sum += heap->fragmentedBytes();
+    }
+    return sum;
+}
+
+void sconsolidate(){
+    for (SmallocArrays* heap : allHeaps) {
+        if (heap->arena_base) {
+            heap->consolidate();
+        }
+    }
+}
+
+void spurge(){
+    for (SmallocArrays* heap : allHeaps) {
+        if (heap->arena_base) {
+            heap->purge();
+        }
+    }
+}
+
 
 
 
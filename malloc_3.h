@@ -0,0 +1,923 @@
+#ifndef MALLOC_3_H
+#define MALLOC_3_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Geometry of the default heap behind smalloc: 128 byte minimum blocks, orders 0..10
+// (128KB top blocks) and 32 top blocks per arena. Other shapes are BuddyHeap instantiations.
+// A heap chains up to MAX_HEAP_ARENAS arenas (the smalloc heap keeps to one), and every
+// heap of one shape shares a registry of MAX_ARENAS arenas.
+#define MIN_BLOCK_SIZE 128
+#define MAX_ORDER 10
+#define ARENA_BLOCKS 32
+#define MAX_HEAP_ARENAS 64
+#define MAX_ARENAS 256
+#define MAX_ALLOC_SIZE 100000000
+
+// Heaps with DeferredCoalescingPolicy park freed blocks on per-order quick lists instead
+// of merging them with their buddies right away. They are coalesced only when a larger
+// order runs dry, when a quick list grows past QUICK_LIST_LIMIT, or on an explicit
+// sconsolidate(). smalloc uses it when malloc_3.cpp is built with -DDEFERRED_COALESCING=1.
+#define QUICK_LIST_LIMIT 16
+
+// Dynamic mmap threshold: mmap'ed blocks up to the threshold are kept in a small cache
+// when freed instead of being unmapped. The threshold starts at the largest buddy block
+// and grows (up to MMAP_THRESHOLD_MAX) when a block above it is freed within
+// SHORT_LIFETIME_TICKS allocations of being created. A block under it that lived for
+// LONG_LIFETIME_TICKS or more drops it back below that block's size. The cache holds at
+// most MMAP_CACHE_SLOTS mappings and MMAP_CACHE_MAX_BYTES bytes, oldest evicted first.
+#define MMAP_THRESHOLD_MAX (32*1024*1024)
+#define MMAP_CACHE_SLOTS 8
+#define MMAP_CACHE_MAX_BYTES (64*1024*1024)
+#define SHORT_LIFETIME_TICKS 64
+#define LONG_LIFETIME_TICKS 4096
+
+// Lifetime hints: smalloc_hint routes short and long lived blocks into heaps of their own
+// so they don't pin each other's buddies. LIFETIME_AUTO keeps a running average lifetime
+// (in allocations) for SITE_SLOTS call sites and predicts SHORT below SHORT_SITE_LIFETIME,
+// once a site has SITE_MIN_SAMPLES frees behind it. Sites are return addresses, so a
+// wrapper that tail-calls smalloc_hint is counted as its own caller's site.
+#define SITE_SLOTS 64
+#define SITE_MIN_SAMPLES 4
+#define SHORT_SITE_LIFETIME 256
+
+
+////////////// Declearations
+
+struct MallocMetadata {
+    int order;
+    unsigned int birth_tick;
+    size_t mm_data_size;
+    bool is_free;
+    bool in_quick_list;
+    bool remote_pending;
+    unsigned short site_slot;
+    MallocMetadata* next;
+    MallocMetadata* prev;
+};
+
+
+// Running totals of a group of lists, kept up to date as blocks come and go so the
+// statistics never have to walk a list
+struct BlockCounts {
+    size_t num_blocks;
+    size_t num_bytes;
+    size_t meta_data_bytes;
+};
+
+class MemoryBlocksList{
+public:
+    MallocMetadata* m_list_head;
+
+    size_t num_blocks;
+    size_t num_bytes;
+    size_t meta_data_bytes;
+
+
+    int order_list;
+    bool is_free_list;
+    size_t block_size;
+    size_t meta_size;
+    BlockCounts* totals;
+
+
+    MemoryBlocksList(){};
+    MemoryBlocksList(int order, bool is_free, size_t block_size = 0, size_t meta_size = sizeof(MallocMetadata),
+                     BlockCounts* totals = nullptr);
+    void add_new_block(MallocMetadata*);
+//    void* find_first_free_block(size_t size);
+    void* remove_block(MallocMetadata*);
+    void push_block(MallocMetadata*);
+    MallocMetadata* pop_block();
+    void update_counts(MallocMetadata*, bool added);
+};
+
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+size_t _num_mmap_calls();
+size_t _num_munmap_calls();
+size_t _num_mmap_cache_hits();
+size_t _num_cached_map_bytes();
+size_t _mmap_threshold();
+size_t _num_fragmented_bytes();
+void sconsolidate();
+
+enum LifetimeHint {
+    LIFETIME_DEFAULT,
+    LIFETIME_SHORT,
+    LIFETIME_LONG,
+    LIFETIME_AUTO
+};
+
+void* smalloc_hint(size_t size, int hint);
+void spurge();
+
+
+////////////// Policies
+
+// Metadata placement: the header sits right in front of the payload and is padded to
+// Align bytes, so every payload is Align aligned (blocks themselves are MinBlock aligned).
+template <size_t Align>
+struct InlineHeader {
+    static_assert((Align & (Align - 1)) == 0, "header alignment must be a power of two");
+    static constexpr size_t alignment = Align;
+    static constexpr size_t size = (sizeof(MallocMetadata) + Align - 1) & ~(Align - 1);
+};
+
+// Locking: anything with lock()/unlock() works (std::mutex included)
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+};
+
+struct SpinLock {
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+    void lock() { while (flag.test_and_set(std::memory_order_acquire)) {} }
+    void unlock() { flag.clear(std::memory_order_release); }
+};
+
+// A policy supplies Header, Lock, deferred_coalescing, max_alloc_size and onFree. Deriving
+// from DefaultBuddyPolicy and overriding some of them is the easy way to write one.
+struct DefaultBuddyPolicy {
+    typedef InlineHeader<alignof(MallocMetadata)> Header;
+    typedef NoLock Lock;
+    static constexpr bool deferred_coalescing = false;
+    static constexpr size_t max_alloc_size = MAX_ALLOC_SIZE;
+
+    // Called under the heap lock once per block that really goes back to the heap,
+    // after the double free checks and before its header is reused
+    static void onFree(MallocMetadata*) {}
+};
+
+// Coalescing is a policy and not a macro, so every translation unit sees the same heap types
+struct DeferredCoalescingPolicy : DefaultBuddyPolicy {
+    static constexpr bool deferred_coalescing = true;
+};
+
+
+////////////// Buddy engine
+//
+// BuddyHeap<MinBlock, MaxOrder, ArenaBlocks, Policy> is one heap: blocks of MinBlock << order
+// bytes for order 0..MaxOrder, carved from an arena of ArenaBlocks top blocks that is aligned
+// to its own size. For example BuddyHeap<64, 10, 64> serves small objects from 64 byte
+// blocks, and BuddyHeap<128, 14, 16> has 2MB top blocks. smalloc uses MemoryArrays below,
+// or the same shape with DeferredCoalescingPolicy (see SmallocArrays in malloc_3.cpp).
+
+template <size_t MinBlock, int MaxOrder, int ArenaBlocks, typename Policy = DefaultBuddyPolicy>
+class BuddyHeap{
+public:
+    typedef typename Policy::Header Header;
+    typedef typename Policy::Lock Lock;
+
+    static constexpr size_t header_size = Header::size;
+    static constexpr size_t top_block_size = MinBlock << MaxOrder;
+    static constexpr size_t arena_size = top_block_size * ArenaBlocks;
+    static constexpr size_t max_alloc_size = Policy::max_alloc_size;
+
+    static_assert((MinBlock & (MinBlock - 1)) == 0, "MinBlock must be a power of two");
+    static_assert((ArenaBlocks & (ArenaBlocks - 1)) == 0, "ArenaBlocks must be a power of two");
+    static_assert(MinBlock > header_size, "MinBlock must leave room for a payload");
+    static_assert(MaxOrder >= 0, "MaxOrder can't be negative");
+
+    static constexpr int log2(size_t value) {
+        return value <= 1 ? 0 : 1 + log2(value >> 1);
+    }
+
+    static constexpr size_t blockSize(int order) {
+        return MinBlock << order;
+    }
+
+    static constexpr size_t payloadSize(int order) {
+        return blockSize(order) - header_size;
+    }
+
+    // Smallest order whose payload holds size bytes, -1 if it needs mmap
+    static constexpr int orderOf(size_t size) {
+        return (size > payloadSize(MaxOrder)) ? -1
+             : (size + header_size <= MinBlock) ? 0
+             : (int)(sizeof(unsigned long long) * 8 - __builtin_clzll((unsigned long long)(size + header_size - 1))) - log2(MinBlock);
+    }
+
+    MemoryBlocksList freeArray[MaxOrder + 1];
+    MemoryBlocksList allocArray[MaxOrder + 1];
+    MemoryBlocksList quickArray[MaxOrder + 1];
+    MemoryBlocksList mmMapedBlocks;
+
+    // Totals of the free and quick lists, of the allocated lists and of the mmap'ed blocks
+    BlockCounts freeCounts;
+    BlockCounts allocCounts;
+    BlockCounts mapCounts;
+
+    size_t num_free_blocks;
+    size_t num_free_Bytes;
+    size_t num_allocated_blocks;
+    size_t num_allocated_Bytes;
+    size_t num_meta_data_Bytes;
+    size_t size_meta_data;
+
+    // Base of the arena_size aligned region being carved (null until the first one is
+    // reserved), the thread that owns the heap, and the lock-free (multi producer /
+    // single consumer) stack of blocks that other threads freed. Whichever thread takes
+    // heap_lock next drains it, so the queue doesn't depend on the owner staying alive.
+    // Ownership only decides whether a free goes straight to the lists or to the queue.
+    char* arena_base;
+    pthread_t owner_thread;
+    std::atomic<MallocMetadata*> remote_frees;
+
+    // Every arena of the heap in reservation order, and how many it may chain. A new
+    // one is reserved when the last is fully carved.
+    char* arenas[MAX_HEAP_ARENAS];
+    int num_arenas;
+    int max_arenas;
+
+    // Top level blocks of the current arena that were never touched. They are still
+    // reported as free MaxOrder blocks by the statistics.
+    int num_uncarved_blocks;
+
+    // Allocation counter used to measure block lifetimes, the current mmap
+    // threshold, the cache of freed mappings and the syscall statistics.
+    unsigned int op_tick;
+    size_t mmap_threshold;
+    MallocMetadata* mmapCache[MMAP_CACHE_SLOTS];
+    int num_cached_maps;
+    size_t cached_map_bytes;
+    size_t num_mmap_calls;
+    size_t num_munmap_calls;
+    size_t num_mmap_cache_hits;
+
+    // Taken by the public entry points below (allocate, deallocate, freeBlock,
+    // consolidate, release), the remote free push never takes it. With NoLock only
+    // the owner may call the entry points, other threads may only free.
+    Lock heap_lock;
+
+    // Every arena of this shape and the heap it belongs to, looked up by arena base.
+    // Slots are never moved: release clears them in place and addArena reuses cleared
+    // ones, both under registryLock. arenaOf reads without the lock, so every field is
+    // accessed atomically and base is published last.
+    struct ArenaEntry {
+        char* base;
+        BuddyHeap* heap;
+    };
+    static ArenaEntry arenaTable[MAX_ARENAS];
+    static int numArenas;
+    static std::mutex registryLock;
+
+    explicit BuddyHeap(int max_arenas = MAX_HEAP_ARENAS);
+    BuddyHeap(const BuddyHeap&) = delete;
+    BuddyHeap& operator=(const BuddyHeap&) = delete;
+    ~BuddyHeap();
+    void reset();
+    void release();
+    void changeStats();
+    void* initArray();
+    char* addArena();
+    MallocMetadata* carveTopBlock();
+    void* allocate(size_t size);
+    void deallocate(void* p, size_t size);
+    void freeBlock(MallocMetadata* meta);
+    void consolidate();
+    void purge();
+    size_t fragmentedBytes();
+
+    void* allocateBlock(size_t size);
+    void* suitsbleBlock(size_t size);
+    void* allocateInHeap(MallocMetadata* where, size_t size);
+    void* allocateFromQuickList(int order);
+    MallocMetadata* mapBlock(size_t size);
+    void unmapBlock(MallocMetadata* meta);
+    MallocMetadata* takeCachedMap(int index);
+    void flushMapCache();
+    bool hasQuickBlocks();
+    void coalesce(MallocMetadata* meta, int order);
+    void consolidate(int order);
+    void consolidateQuickLists();
+    void freeHeap(MallocMetadata* meta, int order);
+    void freeMap(MallocMetadata* meta);
+
+    bool ownedByCurrentThread();
+    void pushRemoteFree(MallocMetadata* meta);
+    void drainRemoteFrees();
+
+    static BuddyHeap* arenaOf(MallocMetadata* meta);
+    static MallocMetadata** remoteLink(MallocMetadata* meta);
+    static size_t mappedLength(size_t size);
+
+};
+
+typedef BuddyHeap<MIN_BLOCK_SIZE, MAX_ORDER, ARENA_BLOCKS> MemoryArrays;
+
+
+//////////////////// BuddyHeap implementation
+
+#define BUDDY_HEAP_TEMPLATE template <size_t MinBlock, int MaxOrder, int ArenaBlocks, typename Policy>
+#define BUDDY_HEAP BuddyHeap<MinBlock, MaxOrder, ArenaBlocks, Policy>
+
+BUDDY_HEAP_TEMPLATE
+typename BUDDY_HEAP::ArenaEntry BUDDY_HEAP::arenaTable[MAX_ARENAS];
+
+BUDDY_HEAP_TEMPLATE
+int BUDDY_HEAP::numArenas = 0;
+
+BUDDY_HEAP_TEMPLATE
+std::mutex BUDDY_HEAP::registryLock;
+
+BUDDY_HEAP_TEMPLATE
+BUDDY_HEAP::BuddyHeap(int max_arenas)
+    : max_arenas(max_arenas < 1 ? 1 : (max_arenas > MAX_HEAP_ARENAS ? MAX_HEAP_ARENAS : max_arenas))
+{
+    reset();
+}
+
+BUDDY_HEAP_TEMPLATE
+BUDDY_HEAP::~BuddyHeap()
+{
+    // Unregisters the arena, so sfree can't find a heap that no longer exists
+    release();
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::reset()
+{
+    size_meta_data = header_size;
+    freeCounts = BlockCounts();
+    allocCounts = BlockCounts();
+    mapCounts = BlockCounts();
+    mmMapedBlocks = MemoryBlocksList(-1, false, 0, header_size, &mapCounts);
+    arena_base = nullptr;
+    remote_frees.store(nullptr);
+    num_arenas = 0;
+    num_uncarved_blocks = 0;
+    op_tick = 0;
+    mmap_threshold = top_block_size;
+    num_cached_maps = 0;
+    cached_map_bytes = 0;
+    num_mmap_calls = 0;
+    num_munmap_calls = 0;
+    num_mmap_cache_hits = 0;
+
+    for (int i = 0; i < MaxOrder + 1; i++){
+        freeArray[i] = MemoryBlocksList(i, true, blockSize(i), header_size, &freeCounts);
+        allocArray[i] = MemoryBlocksList(i, false, blockSize(i), header_size, &allocCounts);
+        quickArray[i] = MemoryBlocksList(i, true, blockSize(i), header_size, &freeCounts);
+    }
+    changeStats();
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::release()
+{
+    std::lock_guard<Lock> guard(heap_lock);
+
+    // Give back everything this heap holds, blocks still handed out become invalid
+    {
+        std::lock_guard<std::mutex> registryGuard(registryLock);
+        for (int i = 0; i < numArenas; ++i) {
+            if (__atomic_load_n(&arenaTable[i].base, __ATOMIC_RELAXED) && arenaTable[i].heap == this) {
+                __atomic_store_n(&arenaTable[i].base, (char*)nullptr, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    MallocMetadata* tmp = mmMapedBlocks.m_list_head;
+    while (tmp != nullptr) {
+        MallocMetadata* next = tmp->next;
+        munmap(tmp, tmp->mm_data_size + size_meta_data);
+        tmp = next;
+    }
+    flushMapCache();
+    for (int i = 0; i < num_arenas; ++i) {
+        munmap(arenas[i], arena_size);
+    }
+
+    reset();
+}
+
+BUDDY_HEAP_TEMPLATE
+void * BUDDY_HEAP::initArray()
+{
+    // The thread that reserves the first arena owns the heap
+    owner_thread = pthread_self();
+    if (!addArena()) {
+        return nullptr;
+    }
+
+    // Return a success indicator (non-null value)
+    return (void*)1;
+}
+
+BUDDY_HEAP_TEMPLATE
+char* BUDDY_HEAP::addArena()
+{
+    if (num_arenas == max_arenas) {
+        return nullptr;
+    }
+
+    // Reserve twice the arena as inaccessible address space so an aligned window is
+    // guaranteed to be inside it. Nothing here is backed by memory until it is carved.
+    // An arena smaller than a page still gets a page of its own, munmap only trims pages.
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t alignmentSize = (arena_size > page) ? arena_size : page;
+    void* reservation = mmap(NULL, 2 * alignmentSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) {
+        return nullptr; // mmap failed
+    }
+
+    // Give the unaligned head and the tail back instead of keeping them as padding
+    char* alignedAddress = (char*)(((uintptr_t)reservation + alignmentSize - 1) & ~((uintptr_t)alignmentSize - 1));
+    size_t headPadding = alignedAddress - (char*)reservation;
+    if (headPadding) {
+        munmap(reservation, headPadding);
+    }
+    munmap(alignedAddress + alignmentSize, alignmentSize - headPadding);
+
+    // Register the arena so sfree can find it from any block's aligned base, in a cleared
+    // slot or a new one. Blocks of an unregistered arena couldn't be freed, so a full
+    // registry gives the reservation back.
+    {
+        std::lock_guard<std::mutex> registryGuard(registryLock);
+        int slot = 0;
+        while (slot < numArenas && __atomic_load_n(&arenaTable[slot].base, __ATOMIC_RELAXED)) {
+            slot++;
+        }
+        if (slot == MAX_ARENAS) {
+            munmap(alignedAddress, alignmentSize);
+            return nullptr;
+        }
+        __atomic_store_n(&arenaTable[slot].heap, this, __ATOMIC_RELAXED);
+        __atomic_store_n(&arenaTable[slot].base, alignedAddress, __ATOMIC_RELEASE);
+        if (slot == numArenas) {
+            __atomic_store_n(&numArenas, numArenas + 1, __ATOMIC_RELEASE);
+        }
+    }
+    arenas[num_arenas++] = alignedAddress;
+    arena_base = alignedAddress;
+
+    // The top level blocks get their headers lazily, see carveTopBlock
+    num_uncarved_blocks = ArenaBlocks;
+    changeStats();
+    return alignedAddress;
+}
+
+BUDDY_HEAP_TEMPLATE
+MallocMetadata* BUDDY_HEAP::carveTopBlock()
+{
+    if (num_uncarved_blocks == 0 && !addArena()) {
+        return nullptr;
+    }
+
+    // Carve in address order, so the arena is touched from the bottom up.
+    // mprotect works on whole pages: top blocks smaller than a page share one, and
+    // opening it again for the next block is harmless
+    char* block = arena_base + (size_t)(ArenaBlocks - num_uncarved_blocks) * top_block_size;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)block & ~(page - 1);
+    uintptr_t end = ((uintptr_t)block + top_block_size + page - 1) & ~(page - 1);
+    if (mprotect((void*)start, end - start, PROT_READ | PROT_WRITE) != 0) {
+        return nullptr;
+    }
+    num_uncarved_blocks--;
+
+    freeArray[MaxOrder].add_new_block((MallocMetadata*)block);
+    return (MallocMetadata*)block;
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::changeStats() {
+    // The lists keep their group totals current, only the uncarved top blocks are added here
+    size_t uncarved_bytes = num_uncarved_blocks * payloadSize(MaxOrder);
+    num_free_blocks = freeCounts.num_blocks + num_uncarved_blocks;
+    num_free_Bytes = freeCounts.num_bytes + uncarved_bytes;
+    num_allocated_blocks = freeCounts.num_blocks + allocCounts.num_blocks + mapCounts.num_blocks + num_uncarved_blocks;
+    num_allocated_Bytes = freeCounts.num_bytes + allocCounts.num_bytes + mapCounts.num_bytes + uncarved_bytes;
+    num_meta_data_Bytes = freeCounts.meta_data_bytes + allocCounts.meta_data_bytes + mapCounts.meta_data_bytes
+                        + num_uncarved_blocks * size_meta_data;
+}
+
+BUDDY_HEAP_TEMPLATE
+void* BUDDY_HEAP::suitsbleBlock(size_t size) {
+    int order = orderOf(size);
+    if(order == -1) return NULL;
+
+    while(order <= MaxOrder){
+        if(freeArray[order].m_list_head != nullptr){
+            return freeArray[order].m_list_head;
+        } else{
+            order ++;
+        }
+    }
+    return nullptr;
+}
+
+BUDDY_HEAP_TEMPLATE
+void*  BUDDY_HEAP::allocateInHeap(MallocMetadata* where,size_t size){
+
+    int order = orderOf(size);
+    freeArray[where->order].remove_block(where);
+
+    // Every split writes a header at the start of the half it gives back, so splitting a
+    // fresh top block touches one page per split order of a page or more (a first 1KB
+    // smalloc makes 6 pages of the arena resident with 4KB pages, not 1).
+    for(int i =  where->order - 1; i >= order; --i){
+        freeArray[i].add_new_block((MallocMetadata*)((char*)where + blockSize(i)));
+    }
+    allocArray[order].add_new_block(where);
+    changeStats();
+    return ((char*)where + size_meta_data);
+}
+
+BUDDY_HEAP_TEMPLATE
+void*  BUDDY_HEAP::allocateFromQuickList(int order){
+    MallocMetadata* where = quickArray[order].pop_block();
+    allocArray[order].add_new_block(where);
+    changeStats();
+    return ((char*)where + size_meta_data);
+}
+
+BUDDY_HEAP_TEMPLATE
+bool BUDDY_HEAP::hasQuickBlocks(){
+    for (int i = 0; i < MaxOrder + 1; i++){
+        if (quickArray[i].m_list_head != nullptr){
+            return true;
+        }
+    }
+    return false;
+}
+
+BUDDY_HEAP_TEMPLATE
+size_t BUDDY_HEAP::mappedLength(size_t size){
+    // munmap works on whole pages, so two blocks with the same page count are interchangeable
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return ((size + header_size + page - 1) / page) * page;
+}
+
+BUDDY_HEAP_TEMPLATE
+MallocMetadata* BUDDY_HEAP::mapBlock(size_t size){
+    MallocMetadata* meta = nullptr;
+
+    // Reuse a cached mapping of the same length, newest first
+    for (int i = num_cached_maps - 1; i >= 0; --i){
+        if (mappedLength(mmapCache[i]->mm_data_size) == mappedLength(size)){
+            meta = takeCachedMap(i);
+            num_mmap_cache_hits++;
+            break;
+        }
+    }
+
+    if (!meta){
+        void* new_block = mmap(NULL, size + size_meta_data, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(new_block == MAP_FAILED){
+            return nullptr;
+        }
+        num_mmap_calls++;
+        meta = (MallocMetadata*)new_block;
+    }
+
+    meta->mm_data_size = size;
+    meta->birth_tick = op_tick;
+    mmMapedBlocks.add_new_block(meta);
+    return meta;
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::unmapBlock(MallocMetadata* meta){
+    mmMapedBlocks.remove_block(meta);
+
+    // A block above the threshold that died young means this size is churning, so
+    // raise the threshold to cover it. A block under it that lived long didn't need
+    // the cache, so lower the threshold below it (never under the largest buddy block).
+    size_t size = meta->mm_data_size;
+    size_t length = mappedLength(size);
+    unsigned int lifetime = op_tick - meta->birth_tick;
+    if (size > mmap_threshold && size <= MMAP_THRESHOLD_MAX && lifetime <= SHORT_LIFETIME_TICKS){
+        mmap_threshold = size;
+    } else if (size <= mmap_threshold && lifetime >= LONG_LIFETIME_TICKS){
+        mmap_threshold = (size - 1 > top_block_size) ? size - 1 : top_block_size;
+    }
+
+    if (size > mmap_threshold || length > MMAP_CACHE_MAX_BYTES){
+        munmap(meta, size + size_meta_data);
+        num_munmap_calls++;
+        return;
+    }
+
+    // Keep the mapping for the next request of this size, evicting the oldest ones
+    // while the cache is out of slots or bytes
+    while (num_cached_maps == MMAP_CACHE_SLOTS || cached_map_bytes + length > MMAP_CACHE_MAX_BYTES){
+        MallocMetadata* oldest = takeCachedMap(0);
+        munmap(oldest, oldest->mm_data_size + size_meta_data);
+        num_munmap_calls++;
+    }
+    meta->is_free = true;
+    mmapCache[num_cached_maps++] = meta;
+    cached_map_bytes += length;
+}
+
+BUDDY_HEAP_TEMPLATE
+MallocMetadata* BUDDY_HEAP::takeCachedMap(int index){
+    // Shift the rest down so mmapCache stays ordered oldest first
+    MallocMetadata* meta = mmapCache[index];
+    for (int i = index + 1; i < num_cached_maps; ++i){
+        mmapCache[i - 1] = mmapCache[i];
+    }
+    num_cached_maps--;
+    cached_map_bytes -= mappedLength(meta->mm_data_size);
+    return meta;
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::flushMapCache(){
+    while (num_cached_maps > 0){
+        MallocMetadata* meta = takeCachedMap(num_cached_maps - 1);
+        munmap(meta, meta->mm_data_size + size_meta_data);
+        num_munmap_calls++;
+    }
+}
+
+BUDDY_HEAP_TEMPLATE
+void* BUDDY_HEAP::allocate(size_t size){
+    std::lock_guard<Lock> guard(heap_lock);
+    return allocateBlock(size);
+}
+
+BUDDY_HEAP_TEMPLATE
+void* BUDDY_HEAP::allocateBlock(size_t size){
+    if (!arena_base && !initArray()) {
+        return nullptr;
+    }
+    drainRemoteFrees();
+    op_tick++;
+
+    // An exact fit parked on a quick list needs no split at all
+    int order = orderOf(size);
+    if (order != -1 && quickArray[order].m_list_head != nullptr){
+        return allocateFromQuickList(order);
+    }
+
+    MallocMetadata* where = (MallocMetadata*)suitsbleBlock(size);
+    if (!where && order != -1 && hasQuickBlocks()){
+        // Larger orders ran dry, merge the parked blocks and look again
+        consolidateQuickLists();
+        changeStats();
+        where = (MallocMetadata*)suitsbleBlock(size);
+    }
+    if (!where && order != -1){
+        // Only now touch a fresh part of the arena
+        where = carveTopBlock();
+    }
+    if(!where){
+
+        if(order != -1){
+            /////// if we got here that means that there is no free block that can contain 'size' bytes and size is not big enough for creating a page for it so we return null
+            return nullptr;
+        }
+        /// code for mmap
+        MallocMetadata * meta = mapBlock(size);
+        if(!meta){
+            return nullptr;
+        }
+        changeStats();
+
+        return ((char *)meta + size_meta_data);
+    }
+
+    return allocateInHeap(where,size);
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::freeMap(MallocMetadata* meta){
+
+    Policy::onFree(meta);
+    unmapBlock(meta);
+    changeStats();
+    return;
+
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::coalesce(MallocMetadata* meta, int order) {
+    MallocMetadata* min_meta = meta;
+    int current_order = order;
+
+    // Attempt to merge with free buddies
+    bool canMerge = true;
+    while (canMerge) {
+        // Calculate the buddy's address
+        MallocMetadata* buddy_meta = (MallocMetadata*)((uintptr_t)min_meta ^ blockSize(current_order));
+
+        // Check if merging is possible (blocks parked on a quick list stay where they are)
+        canMerge = (current_order != MaxOrder
+                    && buddy_meta->is_free
+                    && !buddy_meta->in_quick_list
+                    && buddy_meta->order == current_order);
+
+        if (canMerge) {
+            // Remove buddy from the free list and merge
+            freeArray[buddy_meta->order].remove_block(buddy_meta);
+            min_meta = (min_meta < buddy_meta) ? min_meta : buddy_meta; // Choose the lower address as the new base
+            current_order++;
+        }
+    }
+
+    // Add the (potentially merged) block to the free list
+    freeArray[current_order].add_new_block(min_meta);
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::consolidate(int order) {
+    while (quickArray[order].m_list_head != nullptr) {
+        MallocMetadata* meta = quickArray[order].pop_block();
+        meta->in_quick_list = false;
+        coalesce(meta, order);
+    }
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::consolidateQuickLists() {
+    for (int i = 0; i < MaxOrder + 1; i++) {
+        consolidate(i);
+    }
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::consolidate() {
+    std::lock_guard<Lock> guard(heap_lock);
+    drainRemoteFrees();
+    consolidateQuickLists();
+    changeStats();
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::purge() {
+    std::lock_guard<Lock> guard(heap_lock);
+    drainRemoteFrees();
+    consolidateQuickLists();
+    changeStats();
+    flushMapCache();
+
+    // Keep the page holding the header, hand the rest of every free top block back to the OS
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (top_block_size <= page) {
+        return;
+    }
+    for (MallocMetadata* tmp = freeArray[MaxOrder].m_list_head; tmp != nullptr; tmp = tmp->next) {
+        madvise((char*)tmp + page, top_block_size - page, MADV_DONTNEED);
+    }
+}
+
+BUDDY_HEAP_TEMPLATE
+size_t BUDDY_HEAP::fragmentedBytes() {
+    // Free bytes that are not part of a whole free top block
+    return num_free_Bytes - freeArray[MaxOrder].num_bytes - num_uncarved_blocks * payloadSize(MaxOrder);
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::freeHeap(MallocMetadata* meta, int order) {
+    Policy::onFree(meta);
+
+    // Remove the block from the allocated list
+    allocArray[order].remove_block(meta);
+
+    if (Policy::deferred_coalescing) {
+        // Park the block as is, the next same-order allocation takes it without splitting
+        quickArray[order].push_block(meta);
+        meta->in_quick_list = true;
+        if (quickArray[order].num_blocks > QUICK_LIST_LIMIT) {
+            consolidate(order);
+        }
+    } else {
+        coalesce(meta, order);
+    }
+
+    // Update global statistics
+    changeStats();
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::deallocate(void* p, size_t size) {
+    if (p == nullptr) return;
+    MallocMetadata* meta = (MallocMetadata*)((char*)p - size_meta_data);
+
+    // The caller knows the size it asked for, so the order comes from the size and not from
+    // the block's order field. The header is still read for the double free checks below
+    // (and by the draining thread for remote frees), and written when the block is listed as free.
+    if (!ownedByCurrentThread()) {
+        pushRemoteFree(meta);
+        return;
+    }
+
+    std::lock_guard<Lock> guard(heap_lock);
+    drainRemoteFrees();
+    if (meta->is_free || __atomic_load_n(&meta->remote_pending, __ATOMIC_ACQUIRE)) {
+        return; // freed by the drain above or still queued, this is a double free
+    }
+
+    int order = orderOf(size);
+    if (order == -1) {
+        freeMap(meta);
+    } else {
+        freeHeap(meta, order);
+    }
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::freeBlock(MallocMetadata* meta) {
+    // Blocks freed by a thread that doesn't own the arena are queued for the next lock holder
+    if (!ownedByCurrentThread()) {
+        pushRemoteFree(meta);
+        return;
+    }
+
+    std::lock_guard<Lock> guard(heap_lock);
+    drainRemoteFrees();
+    if (meta->is_free || __atomic_load_n(&meta->remote_pending, __ATOMIC_ACQUIRE)) {
+        return; // freed by the drain above or still queued, this is a double free
+    }
+
+    if(meta->order == -1){
+        freeMap(meta);
+    } else {
+        freeHeap(meta, meta->order);
+    }
+}
+
+BUDDY_HEAP_TEMPLATE
+bool BUDDY_HEAP::ownedByCurrentThread() {
+    return pthread_equal(owner_thread, pthread_self());
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::pushRemoteFree(MallocMetadata* meta) {
+    // is_free can't be set yet (buddies would try to merge with a block still on the
+    // allocated list), so a separate flag claims the block. Losers are double frees.
+    if (__atomic_exchange_n(&meta->remote_pending, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    MallocMetadata* head = remote_frees.load(std::memory_order_relaxed);
+    do {
+        *remoteLink(meta) = head;
+    } while (!remote_frees.compare_exchange_weak(head, meta, std::memory_order_release, std::memory_order_relaxed));
+}
+
+BUDDY_HEAP_TEMPLATE
+void BUDDY_HEAP::drainRemoteFrees() {
+    // Cheap check first so the common (no remote frees) path doesn't write the shared cache line
+    if (remote_frees.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
+
+    // Single consumer: the caller holds heap_lock. Take the whole batch at once,
+    // producers keep pushing onto the now empty stack
+    MallocMetadata* batch = remote_frees.exchange(nullptr, std::memory_order_acquire);
+    while (batch) {
+        MallocMetadata* next = *remoteLink(batch);
+        __atomic_store_n(&batch->remote_pending, false, __ATOMIC_RELAXED);
+        if (batch->order == -1) {
+            freeMap(batch);
+        } else {
+            freeHeap(batch, batch->order);
+        }
+        batch = next;
+    }
+}
+
+BUDDY_HEAP_TEMPLATE
+BUDDY_HEAP* BUDDY_HEAP::arenaOf(MallocMetadata* meta){
+    // Heap blocks live inside an arena aligned to its size, so masking the address gives its base.
+    // mmap'ed blocks don't belong to any arena, the caller decides who tracks them.
+    char* base = (char*)((uintptr_t)meta & ~((uintptr_t)arena_size - 1));
+    int count = __atomic_load_n(&numArenas, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ++i) {
+        if (__atomic_load_n(&arenaTable[i].base, __ATOMIC_ACQUIRE) == base) {
+            return __atomic_load_n(&arenaTable[i].heap, __ATOMIC_RELAXED);
+        }
+    }
+    return nullptr;
+}
+
+BUDDY_HEAP_TEMPLATE
+MallocMetadata** BUDDY_HEAP::remoteLink(MallocMetadata* meta){
+    // A freed block's payload is unused, so the remote free stack links through it
+    return (MallocMetadata**)((char*)meta + header_size);
+}
+
+#undef BUDDY_HEAP
+#undef BUDDY_HEAP_TEMPLATE
+
+
+#endif //MALLOC_3_H
@@ -0,0 +1,128 @@
+// Dynamic mmap threshold and the cache of freed mappings.
+//
+//     g++ -std=c++17 -fsanitize=address,undefined tests/mmap_threshold_test.cpp malloc_3.cpp -o mmap_threshold_test
+//     ./mmap_threshold_test
+
+#include <cassert>
+#include <cstdio>
+#include <unistd.h>
+#include <vector>
+
+#include "../malloc_3.h"
+
+
+// What a block of this size maps, header included, in whole pages
+size_t mappedLength(size_t size){
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return ((size + _size_meta_data() + page - 1) / page) * page;
+}
+
+void churn(int allocations){
+    for (int i = 0; i < allocations; ++i) {
+        sfree(smalloc(10));
+    }
+}
+
+// A block above the threshold that dies young raises it and is cached
+void shortLivedBlockRaisesThreshold(){
+    assert(_mmap_threshold() == (MIN_BLOCK_SIZE << MAX_ORDER));
+    size_t mmaps = _num_mmap_calls();
+    size_t munmaps = _num_munmap_calls();
+
+    sfree(smalloc(200000));
+    assert(_mmap_threshold() == 200000);
+    assert(_num_mmap_calls() == mmaps + 1);
+    assert(_num_munmap_calls() == munmaps);
+    assert(_num_cached_map_bytes() == mappedLength(200000));
+}
+
+// A request with the same page count reuses the cached mapping
+void sameLengthHitsCache(){
+    size_t mmaps = _num_mmap_calls();
+    size_t hits = _num_mmap_cache_hits();
+
+    void* p = smalloc(200000 - 100);
+    assert(p != nullptr);
+    assert(_num_mmap_cache_hits() == hits + 1);
+    assert(_num_mmap_calls() == mmaps);
+    assert(_num_cached_map_bytes() == 0);
+    sfree(p);
+    assert(_num_cached_map_bytes() == mappedLength(200000 - 100));
+}
+
+// A block under the threshold that lived long lowers it and is unmapped
+void longLivedBlockLowersThreshold(){
+    void* p = smalloc(200000);
+    size_t munmaps = _num_munmap_calls();
+
+    churn(LONG_LIFETIME_TICKS);
+    sfree(p);
+    assert(_mmap_threshold() < 200000);
+    assert(_mmap_threshold() >= (MIN_BLOCK_SIZE << MAX_ORDER));
+    assert(_num_munmap_calls() == munmaps + 1);
+    assert(_num_cached_map_bytes() == 0);
+}
+
+// The cache keeps the MMAP_CACHE_SLOTS newest mappings
+void cacheEvictsOldestBySlots(){
+    sfree(smalloc(1000000)); // raise the threshold over everything below
+    assert(_mmap_threshold() == 1000000);
+
+    std::vector<void*> blocks;
+    std::vector<size_t> sizes;
+    for (int i = 0; i < MMAP_CACHE_SLOTS + 1; ++i) {
+        sizes.push_back(200000 + i * 8192); // every one a different page count
+        blocks.push_back(smalloc(sizes.back()));
+    }
+    size_t munmaps = _num_munmap_calls();
+    for (void* p : blocks) {
+        sfree(p);
+    }
+
+    // The 1MB mapping and the first block were evicted, the last MMAP_CACHE_SLOTS stay
+    assert(_num_munmap_calls() == munmaps + 2);
+    size_t expected = 0;
+    for (int i = 1; i < MMAP_CACHE_SLOTS + 1; ++i) {
+        expected += mappedLength(sizes[i]);
+    }
+    assert(_num_cached_map_bytes() == expected);
+}
+
+// The cache never holds more than MMAP_CACHE_MAX_BYTES
+void cacheEvictsOldestByBytes(){
+    const size_t big = 30 * 1024 * 1024;
+    sfree(smalloc(big));
+    assert(_mmap_threshold() == big);
+
+    void* a = smalloc(big);
+    void* b = smalloc(big);
+    void* c = smalloc(big);
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    assert(_num_cached_map_bytes() <= MMAP_CACHE_MAX_BYTES);
+    assert(_num_cached_map_bytes() >= 2 * mappedLength(big));
+}
+
+// spurge() gives every cached mapping back
+void purgeFlushesCache(){
+    size_t munmaps = _num_munmap_calls();
+    assert(_num_cached_map_bytes() > 0);
+    spurge();
+    assert(_num_cached_map_bytes() == 0);
+    assert(_num_munmap_calls() > munmaps);
+}
+
+int main(){
+    sfree(smalloc(1));
+
+    shortLivedBlockRaisesThreshold();
+    sameLengthHitsCache();
+    longLivedBlockLowersThreshold();
+    cacheEvictsOldestBySlots();
+    cacheEvictsOldestByBytes();
+    purgeFlushesCache();
+
+    printf("mmap_threshold_test passed\n");
+    return 0;
+}
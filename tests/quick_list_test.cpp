@@ -0,0 +1,108 @@
+// Deferred coalescing: freed blocks park on per-order quick lists until one of the triggers.
+//
+//     g++ -std=c++17 -DDEFERRED_COALESCING=1 -fsanitize=address,undefined tests/quick_list_test.cpp malloc_3.cpp -o quick_list_test
+//     ./quick_list_test
+
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+#include "../malloc_3.h"
+
+#if !DEFERRED_COALESCING
+#error "build with -DDEFERRED_COALESCING=1 (malloc_3.cpp too)"
+#endif
+
+#define TOP_BLOCKS ARENA_BLOCKS
+#define TOP_PAYLOAD ((MIN_BLOCK_SIZE << MAX_ORDER) - 64)
+#define HALF_PAYLOAD ((MIN_BLOCK_SIZE << (MAX_ORDER - 1)) - 64)
+
+
+// Freed blocks stay split until sconsolidate() merges them
+void freedBlocksAreParked(){
+    assert(_num_free_blocks() == TOP_BLOCKS);
+
+    void* a = smalloc(50);
+    void* b = smalloc(50);
+    size_t freeWhileAllocated = _num_free_blocks();
+
+    sfree(a);
+    sfree(b);
+    assert(_num_free_blocks() == freeWhileAllocated + 2);
+
+    sconsolidate();
+    assert(_num_free_blocks() == TOP_BLOCKS);
+}
+
+// An exact fit comes off the quick list, newest first, without a split
+void exactFitReusesParkedBlock(){
+    void* a = smalloc(50);
+    void* b = smalloc(50);
+    sfree(a);
+    sfree(b);
+    size_t freeWhileParked = _num_free_blocks();
+
+    void* c = smalloc(50);
+    assert(c == b);
+    assert(_num_free_blocks() == freeWhileParked - 1);
+
+    sfree(c);
+    sconsolidate();
+    assert(_num_free_blocks() == TOP_BLOCKS);
+}
+
+// Going past QUICK_LIST_LIMIT merges that order's list right away
+void quickListLimitConsolidates(){
+    std::vector<void*> blocks;
+    for (int i = 0; i < QUICK_LIST_LIMIT + 1; ++i) {
+        blocks.push_back(smalloc(50));
+    }
+    for (int i = 0; i < QUICK_LIST_LIMIT; ++i) {
+        sfree(blocks[i]);
+    }
+    assert(_num_free_blocks() > TOP_BLOCKS);
+
+    sfree(blocks[QUICK_LIST_LIMIT]);
+    assert(_num_free_blocks() == TOP_BLOCKS);
+}
+
+// When the larger orders run dry, an allocation merges the parked blocks and retries
+void dryOrderConsolidates(){
+    std::vector<void*> tops;
+    for (int i = 0; i < TOP_BLOCKS - 1; ++i) {
+        tops.push_back(smalloc(TOP_PAYLOAD));
+        assert(tops.back() != nullptr);
+    }
+
+    // Split the last top block into two halves and park both
+    void* left = smalloc(HALF_PAYLOAD);
+    void* right = smalloc(HALF_PAYLOAD);
+    assert(left != nullptr && right != nullptr);
+    sfree(left);
+    sfree(right);
+    assert(_num_free_blocks() == 2);
+
+    void* top = smalloc(TOP_PAYLOAD);
+    assert(top != nullptr);
+    assert(_num_free_blocks() == 0);
+
+    sfree(top);
+    for (void* p : tops) {
+        sfree(p);
+    }
+    sconsolidate();
+    assert(_num_free_blocks() == TOP_BLOCKS);
+}
+
+int main(){
+    sfree(smalloc(1));
+    sconsolidate();
+
+    freedBlocksAreParked();
+    exactFitReusesParkedBlock();
+    quickListLimitConsolidates();
+    dryOrderConsolidates();
+
+    printf("quick_list_test passed\n");
+    return 0;
+}
@@ -0,0 +1,197 @@
+// Cross-thread (remote) frees through the per-arena lock-free queue.
+//
+//     g++ -std=c++17 -pthread -fsanitize=address,undefined tests/remote_free_test.cpp malloc_3.cpp -o remote_free_test
+//     ./remote_free_test
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../malloc_3.h"
+
+
+// Blocks freed by a worker stay queued until some thread takes the heap lock
+void remoteFreesAreDrainedByNextAllocation(){
+    size_t allocatedBefore = _num_allocated_blocks();
+    size_t freeBefore = _num_free_blocks();
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < 100; ++i) {
+        void* p = smalloc(100 + i * 50);
+        assert(p != nullptr);
+        memset(p, i, 100 + i * 50);
+        blocks.push_back(p);
+    }
+
+    std::thread worker([&]{
+        for (void* p : blocks) {
+            sfree(p);
+        }
+    });
+    worker.join();
+    size_t freeWhileQueued = _num_free_blocks();
+
+    // Any thread's smalloc drains the queue, not only the owner's
+    std::thread other([&]{
+        sfree(smalloc(10));
+    });
+    other.join();
+    assert(_num_free_blocks() > freeWhileQueued);
+
+    sconsolidate();
+    assert(_num_allocated_blocks() == allocatedBefore);
+    assert(_num_free_blocks() == freeBefore);
+}
+
+// A second sfree of the same block from a non-owner thread is ignored
+void doubleRemoteFreeIsIgnored(){
+    size_t freeBefore = _num_free_blocks();
+
+    void* p = smalloc(1000);
+    void* big = smalloc(500000);
+    std::thread worker([&]{
+        sfree(p);
+        sfree(p);
+        sfree(big);
+        sfree(big);
+    });
+    worker.join();
+
+    // The owner freeing it again before draining is a double free too
+    sfree(p);
+
+    void* q = smalloc(1000);
+    assert(q != nullptr);
+    sfree(q);
+    sconsolidate();
+    assert(_num_free_blocks() == freeBefore);
+}
+
+// Many producers pushing at once while the owner keeps allocating
+void concurrentProducers(){
+    size_t freeBefore = _num_free_blocks();
+
+    const int producers = 4;
+    const int perProducer = 500;
+    std::vector<void*> blocks;
+    for (int i = 0; i < producers * perProducer; ++i) {
+        void* p = smalloc(64);
+        assert(p != nullptr);
+        blocks.push_back(p);
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < producers; ++t) {
+        threads.emplace_back([&, t]{
+            for (int i = 0; i < perProducer; ++i) {
+                sfree(blocks[t * perProducer + i]);
+            }
+        });
+    }
+    for (int i = 0; i < 1000; ++i) {
+        sfree(smalloc(64));
+    }
+    for (std::thread& t : threads) {
+        t.join();
+    }
+
+    sfree(smalloc(64));
+    sconsolidate();
+    assert(_num_free_blocks() == freeBefore);
+}
+
+// The owner and another thread allocate, reallocate and free at the same time
+void concurrentAllocators(){
+    size_t freeBefore = _num_free_blocks();
+    size_t allocatedBefore = _num_allocated_blocks();
+
+    auto churn = [](int seed){
+        for (int i = 0; i < 20000; ++i) {
+            size_t size = 16 + ((i * 7919 + seed) % 4000);
+            char* p = (char*)smalloc(size);
+            assert(p != nullptr);
+            memset(p, seed, size);
+            p = (char*)srealloc(p, size * 2);
+            assert(p != nullptr && p[size - 1] == (char)seed);
+            sfree(p);
+            if (i % 1000 == 0) {
+                sfree(smalloc(200000)); // an mmap'ed block every now and then
+            }
+        }
+    };
+    std::thread worker(churn, 1);
+    churn(2);
+    worker.join();
+
+    sconsolidate();
+    assert(_num_allocated_blocks() == allocatedBefore);
+    assert(_num_free_blocks() == freeBefore);
+}
+
+// The thread that owns a heap exits, the blocks it handed out are freed by another thread
+struct LockedPolicy : DefaultBuddyPolicy {
+    typedef std::mutex Lock;
+};
+
+void ownerThreadExits(){
+    BuddyHeap<MIN_BLOCK_SIZE, MAX_ORDER, ARENA_BLOCKS, LockedPolicy> heap;
+    std::vector<void*> blocks;
+    std::thread io([&]{
+        for (int i = 0; i < 1000; ++i) {
+            blocks.push_back(heap.allocate(2000));
+            assert(blocks.back() != nullptr);
+        }
+    });
+    io.join();
+
+    for (void* p : blocks) {
+        heap.deallocate(p, 2000);
+    }
+    heap.consolidate();
+    assert(heap.num_free_blocks == heap.num_allocated_blocks);
+}
+
+// Heaps of one shape come and go on several threads while their blocks are freed through sfree's lookup
+void heapsComeAndGo(){
+    typedef BuddyHeap<MIN_BLOCK_SIZE, MAX_ORDER, ARENA_BLOCKS, LockedPolicy> LockedArrays;
+
+    auto cycle = []{
+        for (int round = 0; round < 50; ++round) {
+            LockedArrays heap;
+            std::vector<void*> blocks;
+            for (int i = 0; i < 2 * ARENA_BLOCKS; ++i) { // enough top blocks for a second arena
+                void* p = heap.allocate((MIN_BLOCK_SIZE << MAX_ORDER) - 64);
+                assert(p != nullptr);
+                blocks.push_back(p);
+            }
+            for (void* p : blocks) {
+                assert(LockedArrays::arenaOf((MallocMetadata*)((char*)p - heap.size_meta_data)) == &heap);
+                heap.deallocate(p, (MIN_BLOCK_SIZE << MAX_ORDER) - 64);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back(cycle);
+    }
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+int main(){
+    sfree(smalloc(1)); // the calling thread becomes the owner of the global heap
+    sconsolidate();
+
+    remoteFreesAreDrainedByNextAllocation();
+    doubleRemoteFreeIsIgnored();
+    concurrentProducers();
+    concurrentAllocators();
+    ownerThreadExits();
+    heapsComeAndGo();
+
+    printf("remote_free_test passed\n");
+    return 0;
+}